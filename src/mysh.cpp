@@ -1,18 +1,28 @@
+#include <algorithm>
 #include <cerrno>
+#include <climits>
+#include <cmath>
 #include <csignal>
 #include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
+#include <fnmatch.h>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <pthread.h>
+#include <regex.h>
 #include <set>
 #include <sstream>
 #include <stdexcept>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <vector>
 
@@ -20,6 +30,14 @@
 #define HISTORY_FILE_PATH "./" HISTORY_FILE_NAME
 #define MAX_PATH_LENGTH   512
 
+// Defaults for splitting large files across threads when copying
+#define PARALLEL_COPY_THRESHOLD (256LL * 1024 * 1024)
+#define PARALLEL_COPY_CHUNK     (64LL * 1024 * 1024)
+#define COPY_BUFFER_SIZE        (1024 * 1024)
+
+// Size of the buffer regerror writes an invalid regex's error message into
+#define REGEX_ERROR_LENGTH 256
+
 // Used to print in color in debug mode
 #ifdef DEBUG
 #define BLUE  "\x1B[34m"
@@ -31,6 +49,69 @@
 std::set<pid_t> activePids;
 std::set<std::string> VALID_COMMANDS;
 
+// Summary statistics for a series of benchmark samples
+struct SampleStats {
+    double mean;
+    double stddev;
+    double min;
+    double p50;
+    double p95;
+    double p99;
+};
+
+// Controls when and how large files are split into ranges that
+// are copied concurrently by multiple threads
+struct CopyOptions {
+    off_t parallelThreshold; // Files at least this large are copied in parallel
+    off_t chunkSize;         // Size of the range each thread copies at a time
+    int threads;             // Maximum number of threads used per file
+};
+
+// A set of --include or --exclude rules compiled for fast matching. Globs without
+// wildcards or slashes are looked up by name, other globs are matched with fnmatch
+// (against the entry's name, or its path relative to the source directory when the
+// glob contains a '/') and regexes are compiled once and matched against the path.
+// The matcher owns its compiled regexes, so it can't be copied.
+struct PathMatcher {
+    std::set<std::string> names;
+    std::vector<std::string> nameGlobs;
+    std::vector<std::string> pathGlobs;
+    std::vector<regex_t*> regexes;
+
+    PathMatcher() {}
+
+    ~PathMatcher() {
+        for (int i = 0; i < static_cast<int>(regexes.size()); i++) {
+            regfree(regexes[i]);
+            delete regexes[i];
+        }
+    }
+
+private:
+    PathMatcher(const PathMatcher&);
+    PathMatcher& operator=(const PathMatcher&);
+};
+
+// Decides which entries coppyabode skips. Excluded directories are pruned without
+// being opened. If any include rules exist, only files matching one (or inside a
+// directory matching one) are copied.
+struct CopyFilter {
+    PathMatcher include;
+    PathMatcher exclude;
+};
+
+// State shared by the threads copying a single file. Each thread claims the
+// next unclaimed chunk (under the lock) until the whole file has been copied.
+struct ChunkCopyJob {
+    int sourceFd;
+    int destFd;
+    off_t fileSize;
+    off_t chunkSize;
+    off_t nextOffset;
+    int error;
+    pthread_mutex_t lock;
+};
+
 void parseCommand(
     const std::string& command,
     const std::vector<std::string>& args,
@@ -49,6 +130,16 @@ void replayCommand(const std::vector<std::string>& history, int index);
 // program finishes executing.
 void startProgram(const std::vector<std::string>& args, bool background);
 
+// Forks and executes the program described by args (args[0] is the program path).
+// Returns the PID of the child process, or -1 if the program doesn't exist or
+// the process couldn't be forked.
+pid_t spawnProgram(const std::vector<std::string>& args);
+
+// Takes a number of runs, optional "--warmup [runs]", "--csv" and "--json" flags, and a
+// program (plus its arguments). Runs the program repeatedly in the foreground and
+// reports wall, user and sys time as well as max RSS (mean, stddev, min, p50/p95/p99).
+void benchmarkProgram(const std::vector<std::string>& args);
+
 // Takes a program name, number of repetitions, and (optionally) additional arguments
 // that are passed to that program and starts n processes of that program
 void repeatCommand(const std::vector<std::string>& args);
@@ -73,15 +164,48 @@ void createAndWriteToFile(const std::string& filename);
 // If the source file doesn't exist, or the destination's directory doesn't
 // exist, this will print an error. If force is true, the file in the
 // destination path will be overriden if it already exists.
-void copyFileToFile(const std::string& source, const std::string& dest, const bool force);
+// Files at least options.parallelThreshold bytes large are copied in chunks
+// by up to options.threads threads (see copyFileInParallel).
+void copyFileToFile(const std::string& source, const std::string& dest, const bool force, const CopyOptions& options);
+
+// Preallocates the destination file and copies the source file in
+// options.chunkSize ranges using up to options.threads threads. Returns false
+// without touching the destination if it isn't a regular file (e.g. a device
+// or a symlink), in which case the caller should copy sequentially instead.
+bool copyFileInParallel(const std::string& source, const std::string& dest, const CopyOptions& options);
+
+// Thread entry point for copyFileInParallel. Takes a ChunkCopyJob and copies
+// chunks with pread/pwrite until none are left or an error occurs.
+void* copyChunks(void* arg);
+
+// Takes the arguments to coppy or coppyabode, applies any "--threads",
+// "--chunk-size" and "--parallel-threshold" flags to options and stores the
+// remaining arguments in positional. If filter isn't NULL, "--include",
+// "--exclude", "--include-regex" and "--exclude-regex" rules are compiled
+// into it. Returns false if a flag is invalid.
+bool parseCopyFlags(
+    const std::vector<std::string>& args,
+    CopyOptions& options,
+    CopyFilter* filter,
+    std::vector<std::string>& positional);
 
 // Causes "path" to become the current working directory.
 // This supports both absolute and relative paths.
 void moveToDirectory(const std::string& path);
 
 // Recursively copies all files and subdirectories from the source directory
-// to the destination directory
-void copyDirectory(const char* source, const char* dest);
+// to the destination directory, skipping anything the filter excludes.
+// relativePath is the source directory's path relative to the top-level source.
+// included is true if every file in the source directory passes the include
+// rules (there are none, or the directory is inside one that matched). Otherwise
+// the destination directory is only created once a file is copied into it.
+void copyDirectory(
+    const char* source,
+    const char* dest,
+    const CopyOptions& options,
+    const CopyFilter& filter,
+    const std::string& relativePath,
+    const bool included);
 
 namespace Util {
     char* getCurrentDir() {
@@ -150,6 +274,24 @@ namespace Util {
         return S_ISDIR(pathStat.st_mode) == 1;
     }
 
+    // Creates the directory at path along with any missing parent directories.
+    // Returns 0 if successful and -1 (with errno set) if an error occurred.
+    int makeDirectories(const std::string& path) {
+        for (int i = 1; i <= static_cast<int>(path.size()); i++) {
+            if (i < static_cast<int>(path.size()) && path[i] != '/') {
+                continue;
+            }
+
+            std::string prefix = path.substr(0, i);
+
+            if (!Util::isDirectory(prefix) && mkdir(prefix.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) != 0) {
+                return -1;
+            }
+        }
+
+        return 0;
+    }
+
     // Saves the current shell's history to the history file (this
     // will append new history to the end). Returns 0 if successful and
     // -1 if an error occurred.
@@ -205,10 +347,189 @@ namespace Util {
         }
         return true;
     }
+
+    // Returns the current time of the monotonic clock in milliseconds.
+    double getMonotonicMillis() {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+    }
+
+    // Converts a timeval (as found in struct rusage) to milliseconds.
+    double timevalToMillis(const struct timeval& time) {
+        return time.tv_sec * 1000.0 + time.tv_usec / 1000.0;
+    }
+
+    // Takes a sorted, non-empty vector of samples and returns the value at the
+    // given percentile using the nearest-rank method.
+    double percentile(const std::vector<double>& sorted, const double percent) {
+        int rank = static_cast<int>(std::ceil(percent / 100.0 * sorted.size()));
+        return sorted[std::max(rank, 1) - 1];
+    }
+
+    // Takes a non-empty vector of samples and computes the mean, sample
+    // standard deviation, minimum and p50/p95/p99 percentiles.
+    SampleStats computeStats(const std::vector<double>& samples) {
+        std::vector<double> sorted = samples;
+        std::sort(sorted.begin(), sorted.end());
+
+        double sum = 0;
+        for (int i = 0; i < static_cast<int>(sorted.size()); i++) {
+            sum += sorted[i];
+        }
+
+        SampleStats stats;
+        stats.mean = sum / sorted.size();
+
+        double squaredDiffs = 0;
+        for (int i = 0; i < static_cast<int>(sorted.size()); i++) {
+            squaredDiffs += (sorted[i] - stats.mean) * (sorted[i] - stats.mean);
+        }
+
+        stats.stddev = sorted.size() > 1 ? std::sqrt(squaredDiffs / (sorted.size() - 1)) : 0;
+        stats.min = sorted[0];
+        stats.p50 = Util::percentile(sorted, 50);
+        stats.p95 = Util::percentile(sorted, 95);
+        stats.p99 = Util::percentile(sorted, 99);
+
+        return stats;
+    }
+
+    // Returns the options coppy and coppyabode use when no flags are given.
+    CopyOptions defaultCopyOptions() {
+        CopyOptions options;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        options.parallelThreshold = PARALLEL_COPY_THRESHOLD;
+        options.chunkSize = PARALLEL_COPY_CHUNK;
+        options.threads = cpus > 0 ? static_cast<int>(cpus) : 1;
+
+        return options;
+    }
+
+    // Takes a string such as "512", "64K", "256M" or "2G" and stores the number
+    // of bytes it represents in size. Returns false if the string isn't valid
+    // or the size is too large to represent.
+    bool parseByteSize(const std::string& input, off_t& size) {
+        std::string digits = input;
+        off_t multiplier = 1;
+
+        if (!digits.empty() && !isdigit(digits[digits.size() - 1])) {
+            switch (toupper(digits[digits.size() - 1])) {
+                case 'K':
+                    multiplier = 1024LL;
+                    break;
+                case 'M':
+                    multiplier = 1024LL * 1024;
+                    break;
+                case 'G':
+                    multiplier = 1024LL * 1024 * 1024;
+                    break;
+                default:
+                    return false;
+            }
+            digits.erase(digits.size() - 1);
+        }
+
+        if (digits.empty() || !Util::isValidNumber(digits)) {
+            return false;
+        }
+
+        errno = 0;
+        long long value = strtoll(digits.c_str(), NULL, 10);
+
+        if (errno == ERANGE || value < 0 || value > LLONG_MAX / multiplier) {
+            return false;
+        }
+
+        size = static_cast<off_t>(value * multiplier);
+        return true;
+    }
+
+    // Compiles a glob (or a POSIX extended regex if isRegex is true) into the
+    // matcher. Returns false and prints an error if the regex is invalid.
+    bool addPathRule(PathMatcher& matcher, const std::string& pattern, const bool isRegex) {
+        if (isRegex) {
+            regex_t* regex = new regex_t;
+            int errorCode = regcomp(regex, pattern.c_str(), REG_EXTENDED | REG_NOSUB);
+
+            if (errorCode != 0) {
+                char message[REGEX_ERROR_LENGTH];
+                regerror(errorCode, regex, message, sizeof(message));
+                std::cerr << "mysh: Invalid regex '" << pattern << "': " << message << std::endl;
+                delete regex;
+                return false;
+            }
+
+            matcher.regexes.push_back(regex);
+        } else if (pattern.find('/') != std::string::npos) {
+            matcher.pathGlobs.push_back(pattern);
+        } else if (pattern.find_first_of("*?[\\") != std::string::npos) {
+            matcher.nameGlobs.push_back(pattern);
+        } else {
+            matcher.names.insert(pattern);
+        }
+
+        return true;
+    }
+
+    // Returns true if the matcher has no rules.
+    bool isMatcherEmpty(const PathMatcher& matcher) {
+        return matcher.names.empty() &&
+               matcher.nameGlobs.empty() &&
+               matcher.pathGlobs.empty() &&
+               matcher.regexes.empty();
+    }
+
+    // Takes an entry's name and its path relative to the source directory and
+    // returns true if any of the matcher's rules match it.
+    bool matchesPath(const PathMatcher& matcher, const char* name, const std::string& relativePath) {
+        if (matcher.names.find(name) != matcher.names.end()) {
+            return true;
+        }
+
+        for (int i = 0; i < static_cast<int>(matcher.nameGlobs.size()); i++) {
+            if (fnmatch(matcher.nameGlobs[i].c_str(), name, 0) == 0) {
+                return true;
+            }
+        }
+
+        for (int i = 0; i < static_cast<int>(matcher.pathGlobs.size()); i++) {
+            if (fnmatch(matcher.pathGlobs[i].c_str(), relativePath.c_str(), FNM_PATHNAME) == 0) {
+                return true;
+            }
+        }
+
+        for (int i = 0; i < static_cast<int>(matcher.regexes.size()); i++) {
+            if (regexec(matcher.regexes[i], relativePath.c_str(), 0, NULL, 0) == 0) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    // Returns true if the entry should be skipped. Directories are only skipped
+    // by exclude rules, since files beneath them may still match an include rule.
+    // included is true if the entry's parent directory passed the include rules.
+    bool isPathExcluded(
+        const CopyFilter& filter,
+        const char* name,
+        const std::string& relativePath,
+        const bool isDirectory,
+        const bool included) {
+
+        if (Util::matchesPath(filter.exclude, name, relativePath)) {
+            return true;
+        }
+
+        return !isDirectory && !included && !Util::matchesPath(filter.include, name, relativePath);
+    }
 }
 
 int main() {
     VALID_COMMANDS.insert("background");
+    VALID_COMMANDS.insert("bench");
     VALID_COMMANDS.insert("byebye");
     VALID_COMMANDS.insert("coppy");
     VALID_COMMANDS.insert("coppyabode");
@@ -274,6 +595,15 @@ void parseCommand(
         startProgram(args, command == "background");
     }
 
+    if (command == "bench") {
+        if (args.size() < 2) {
+            std::cerr << "mysh: Usage: bench [runs] [--warmup runs] [--csv | --json] [program]" << std::endl;
+            return;
+        }
+
+        benchmarkProgram(args);
+    }
+
     if (command == "byebye") {
         exit(Util::writeHistory(history));
     }
@@ -351,21 +681,37 @@ void parseCommand(
     }
 
     if (command == "coppy") {
-        if (args.size() < 2) {
-            std::cerr << "mysh: Usage: coppy [source] [destination]" << std::endl;
+        CopyOptions options = Util::defaultCopyOptions();
+        std::vector<std::string> paths;
+
+        if (!parseCopyFlags(args, options, NULL, paths)) {
+            return;
+        }
+
+        if (paths.size() < 2) {
+            std::cerr << "mysh: Usage: coppy [--threads n] [--chunk-size bytes] [--parallel-threshold bytes] [source] [destination]" << std::endl;
         } else {
-            copyFileToFile(args[0], args[1], false);
+            copyFileToFile(paths[0], paths[1], false, options);
         }
     }
 
     if (command == "coppyabode") {
-        if (args.size() < 2) {
-            std::cerr << "mysh: Usage: coppyabode [source-dir] [target-dir]" << std::endl;
+        CopyOptions options = Util::defaultCopyOptions();
+        CopyFilter filter;
+        std::vector<std::string> paths;
+
+        if (!parseCopyFlags(args, options, &filter, paths)) {
+            return;
+        }
+
+        if (paths.size() < 2) {
+            std::cerr << "mysh: Usage: coppyabode [--threads n] [--chunk-size bytes] [--parallel-threshold bytes] "
+                      << "[--include | --exclude glob] [--include-regex | --exclude-regex regex] [source-dir] [target-dir]" << std::endl;
             return;
         }
 
-        std::string source = args[0];
-        std::string dest = args[1];
+        std::string source = paths[0];
+        std::string dest = paths[1];
 
         // Need to replace any leading "./" because it causes the copyDirectory
         // function to recurse into the dest directory and copy infinitely
@@ -382,8 +728,63 @@ void parseCommand(
             return;
         }
 
-        copyDirectory(source.c_str(), dest.c_str());
+        copyDirectory(source.c_str(), dest.c_str(), options, filter, "", Util::isMatcherEmpty(filter.include));
+    }
+}
+
+bool parseCopyFlags(
+    const std::vector<std::string>& args,
+    CopyOptions& options,
+    CopyFilter* filter,
+    std::vector<std::string>& positional) {
+
+    for (int i = 0; i < static_cast<int>(args.size()); i++) {
+        const std::string& arg = args[i];
+        bool isFilterFlag = arg == "--include" || arg == "--exclude" || arg == "--include-regex" || arg == "--exclude-regex";
+
+        if (arg != "--threads" && arg != "--chunk-size" && arg != "--parallel-threshold" && !isFilterFlag) {
+            positional.push_back(arg);
+            continue;
+        }
+
+        if (isFilterFlag && filter == NULL) {
+            std::cerr << "mysh: " << arg << " is only supported by coppyabode" << std::endl;
+            return false;
+        }
+
+        if (i + 1 >= static_cast<int>(args.size())) {
+            std::cerr << "mysh: Missing value for " << arg << std::endl;
+            return false;
+        }
+
+        const std::string& value = args[++i];
+
+        if (isFilterFlag) {
+            PathMatcher& matcher = arg.find("--include") == 0 ? filter->include : filter->exclude;
+            bool isRegex = arg.find("-regex") != std::string::npos;
+
+            if (!Util::addPathRule(matcher, value, isRegex)) {
+                return false;
+            }
+        } else if (arg == "--threads") {
+            if (!Util::isValidNumber(value) || atoi(value.c_str()) < 1) {
+                std::cerr << "mysh: Argument [--threads] must be a number greater than 0" << std::endl;
+                return false;
+            }
+
+            options.threads = atoi(value.c_str());
+        } else if (arg == "--chunk-size") {
+            if (!Util::parseByteSize(value, options.chunkSize) || options.chunkSize < 1) {
+                std::cerr << "mysh: Argument [--chunk-size] must be a size greater than 0 (e.g. 64M)" << std::endl;
+                return false;
+            }
+        } else if (!Util::parseByteSize(value, options.parallelThreshold) || options.parallelThreshold < 0) {
+            std::cerr << "mysh: Argument [--parallel-threshold] must be a size (e.g. 256M)" << std::endl;
+            return false;
+        }
     }
+
+    return true;
 }
 
 void showHistory(std::vector<std::string>& history, const std::vector<std::string>& args) {
@@ -425,10 +826,28 @@ void replayCommand(const std::vector<std::string>& history, const int index) {
 }
 
 void startProgram(const std::vector<std::string>& args, bool background) {
+    pid_t pid = spawnProgram(args);
+
+    if (pid == -1) {
+        return;
+    }
+
+    activePids.insert(pid);
+
+    if (background) {
+        std::cout << "mysh: Spawned process with pid " << pid << std::endl;
+    } else {
+        int status;
+        waitpid(pid, &status, 0);
+        activePids.erase(pid);
+    }
+}
+
+pid_t spawnProgram(const std::vector<std::string>& args) {
     // Check if the file exists before running, so we don't unnecessarily fork
     if (!Util::doesFileOrDirExist(args[0])) {
         std::cerr << "mysh: " << args[0] << ": No such file or directory" << std::endl;
-        return;
+        return -1;
     }
 
     // execv ony takes a char** array, so we need to convert the string vector
@@ -445,11 +864,10 @@ void startProgram(const std::vector<std::string>& args, bool background) {
 
     if (pid == -1) {
         std::cerr << "mysh: Couldn't fork process." << std::endl;
-        return;
+        delete[] programArgs;
+        return -1;
     }
 
-    activePids.insert(pid);
-
     if (pid == 0) {
         // This process is the child process, so we need to make sure the
         // process exits with it finishes
@@ -459,18 +877,163 @@ void startProgram(const std::vector<std::string>& args, bool background) {
             std::cerr << "mysh: " << std::strerror(errno) << std::endl;
         }
 
-        activePids.erase(pid);
         exit(statusCode);
-    } else {
-        // This is the original process (the one that started the child process)
-        if (background) {
-            std::cout << "mysh: Spawned process with pid " << pid << std::endl;
+    }
+
+    // This is the original process (the one that started the child process)
+    delete[] programArgs;
+
+    return pid;
+}
+
+void benchmarkProgram(const std::vector<std::string>& args) {
+    if (!Util::isValidNumber(args[0]) || atoi(args[0].c_str()) < 1) {
+        std::cerr << "mysh: Argument [runs] must be a number greater than 0" << std::endl;
+        return;
+    }
+
+    int runs = atoi(args[0].c_str());
+    int warmup = 0;
+    bool csv = false;
+    bool json = false;
+    int index = 1;
+
+    // Flags are only recognized before the program, everything after
+    // the program path is passed through to the program untouched
+    for (; index < static_cast<int>(args.size()) && args[index].find("--") == 0; index++) {
+        if (args[index] == "--warmup") {
+            if (index + 1 >= static_cast<int>(args.size()) || !Util::isValidNumber(args[index + 1])) {
+                std::cerr << "mysh: Argument [--warmup] must be a number" << std::endl;
+                return;
+            }
+
+            warmup = atoi(args[++index].c_str());
+        } else if (args[index] == "--csv") {
+            csv = true;
+        } else if (args[index] == "--json") {
+            json = true;
         } else {
-            int status;
-            waitpid(pid, &status, 0);
-            activePids.erase(pid);
+            std::cerr << "mysh: bench: Unknown option " << args[index] << std::endl;
+            return;
+        }
+    }
+
+    if (csv && json) {
+        std::cerr << "mysh: bench: Only one of --csv and --json may be used" << std::endl;
+        return;
+    }
+
+    if (index >= static_cast<int>(args.size())) {
+        std::cerr << "mysh: Missing argument [program]" << std::endl;
+        return;
+    }
+
+    std::vector<std::string> command = std::vector<std::string>(args.begin() + index, args.end());
+    std::vector<double> wallTimes;
+    std::vector<double> userTimes;
+    std::vector<double> sysTimes;
+    std::vector<double> maxRss;
+
+    for (int i = 0; i < warmup + runs; i++) {
+        double start = Util::getMonotonicMillis();
+        pid_t pid = spawnProgram(command);
+
+        if (pid == -1) {
+            return;
+        }
+
+        int status;
+        struct rusage usage;
+
+        // wait4 gives us the child's resource usage on its own, which
+        // getrusage(RUSAGE_CHILDREN) can only give us accumulated
+        if (wait4(pid, &status, 0, &usage) == -1) {
+            std::cerr << "mysh: " << std::strerror(errno) << std::endl;
+            return;
+        }
+
+        double end = Util::getMonotonicMillis();
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            std::cerr << "mysh: bench: " << command[0] << " failed on run " << i + 1;
+
+            if (WIFSIGNALED(status)) {
+                std::cerr << " (" << strsignal(WTERMSIG(status)) << ")" << std::endl;
+            } else {
+                std::cerr << " (exit status " << WEXITSTATUS(status) << ")" << std::endl;
+            }
+            return;
+        }
+
+        if (i < warmup) {
+            continue;
+        }
+
+        wallTimes.push_back(end - start);
+        userTimes.push_back(Util::timevalToMillis(usage.ru_utime));
+        sysTimes.push_back(Util::timevalToMillis(usage.ru_stime));
+        // ru_maxrss is reported in kilobytes on Linux
+        maxRss.push_back(static_cast<double>(usage.ru_maxrss));
+    }
+
+    const char* names[] = {"wall_ms", "user_ms", "sys_ms", "max_rss_kb"};
+    SampleStats stats[] = {
+        Util::computeStats(wallTimes),
+        Util::computeStats(userTimes),
+        Util::computeStats(sysTimes),
+        Util::computeStats(maxRss)};
+    const int numMetrics = sizeof(names) / sizeof(names[0]);
+
+    std::ios_base::fmtflags flags = std::cout.flags();
+    std::streamsize precision = std::cout.precision();
+    std::cout << std::fixed << std::setprecision(3);
+
+    if (csv) {
+        std::cout << "metric,runs,mean,stddev,min,p50,p95,p99" << std::endl;
+
+        for (int i = 0; i < numMetrics; i++) {
+            std::cout << names[i] << "," << runs << ","
+                      << stats[i].mean << "," << stats[i].stddev << "," << stats[i].min << ","
+                      << stats[i].p50 << "," << stats[i].p95 << "," << stats[i].p99 << std::endl;
+        }
+    } else if (json) {
+        std::cout << "{\"runs\": " << runs << ", \"warmup\": " << warmup;
+
+        for (int i = 0; i < numMetrics; i++) {
+            std::cout << ", \"" << names[i] << "\": {"
+                      << "\"mean\": " << stats[i].mean << ", "
+                      << "\"stddev\": " << stats[i].stddev << ", "
+                      << "\"min\": " << stats[i].min << ", "
+                      << "\"p50\": " << stats[i].p50 << ", "
+                      << "\"p95\": " << stats[i].p95 << ", "
+                      << "\"p99\": " << stats[i].p99 << "}";
+        }
+
+        std::cout << "}" << std::endl;
+    } else {
+        std::cout << "mysh: " << runs << (runs == 1 ? " run" : " runs")
+                  << " of " << command[0] << " (" << warmup << " warmup)" << std::endl;
+        std::cout << std::left << std::setw(12) << "metric" << std::right;
+
+        const char* columns[] = {"mean", "stddev", "min", "p50", "p95", "p99"};
+        for (int i = 0; i < 6; i++) {
+            std::cout << std::setw(14) << columns[i];
+        }
+        std::cout << std::endl;
+
+        for (int i = 0; i < numMetrics; i++) {
+            std::cout << std::left << std::setw(12) << names[i] << std::right
+                      << std::setw(14) << stats[i].mean
+                      << std::setw(14) << stats[i].stddev
+                      << std::setw(14) << stats[i].min
+                      << std::setw(14) << stats[i].p50
+                      << std::setw(14) << stats[i].p95
+                      << std::setw(14) << stats[i].p99 << std::endl;
         }
     }
+
+    std::cout.flags(flags);
+    std::cout.precision(precision);
 }
 
 bool terminateProcess(const pid_t pid) {
@@ -559,7 +1122,7 @@ void createAndWriteToFile(const std::string& filename) {
     file.close();
 }
 
-void copyFileToFile(const std::string& source, const std::string& dest, const bool force) {
+void copyFileToFile(const std::string& source, const std::string& dest, const bool force, const CopyOptions& options) {
     if (!Util::doesFileOrDirExist(source) || Util::isDirectory(source)) {
         std::cerr << "mysh: " << source << ": No such file" << std::endl;
         return;
@@ -575,6 +1138,16 @@ void copyFileToFile(const std::string& source, const std::string& dest, const bo
         return;
     }
 
+    struct stat sourceStat;
+
+    // Large files always take the fd-based path (even with a single thread),
+    // since the line-based copy below buffers whole lines in memory
+    if (stat(source.c_str(), &sourceStat) == 0 &&
+        sourceStat.st_size >= options.parallelThreshold &&
+        copyFileInParallel(source, dest, options)) {
+        return;
+    }
+
     std::ifstream sourceFile;
     std::ofstream destFile;
     std::string content;
@@ -604,6 +1177,177 @@ void copyFileToFile(const std::string& source, const std::string& dest, const bo
     sourceFile.close();
 }
 
+bool copyFileInParallel(const std::string& source, const std::string& dest, const CopyOptions& options) {
+    int sourceFd = open(source.c_str(), O_RDONLY);
+
+    if (sourceFd == -1) {
+        std::cerr << "mysh: " << source << ": " << std::strerror(errno) << std::endl;
+        return true;
+    }
+
+    struct stat sourceStat;
+
+    if (fstat(sourceFd, &sourceStat) != 0) {
+        std::cerr << "mysh: " << source << ": " << std::strerror(errno) << std::endl;
+        close(sourceFd);
+        return true;
+    }
+
+    // Don't follow symlinks or truncate yet, since the destination is only
+    // preallocated (and removed if the copy fails) when it's a regular file
+    int destFd = open(dest.c_str(), O_WRONLY | O_CREAT | O_NOFOLLOW, 0666);
+
+    if (destFd == -1 && errno == ELOOP) {
+        close(sourceFd);
+        return false;
+    }
+
+    if (destFd == -1) {
+        std::cerr << "mysh: " << dest << ": " << std::strerror(errno) << std::endl;
+        close(sourceFd);
+        return true;
+    }
+
+    struct stat destStat;
+
+    if (fstat(destFd, &destStat) != 0 || !S_ISREG(destStat.st_mode)) {
+        close(destFd);
+        close(sourceFd);
+        return false;
+    }
+
+    // Reserve all the blocks up front so the threads writing at different
+    // offsets don't fragment the file. Not every filesystem supports
+    // fallocate, in which case we only set the file's size.
+    if (ftruncate(destFd, 0) != 0 ||
+        (sourceStat.st_size > 0 &&
+         fallocate(destFd, 0, 0, sourceStat.st_size) != 0 &&
+         ((errno != EOPNOTSUPP && errno != ENOSYS) || ftruncate(destFd, sourceStat.st_size) != 0))) {
+        std::cerr << "mysh: " << dest << ": " << std::strerror(errno) << std::endl;
+        close(destFd);
+        close(sourceFd);
+        unlink(dest.c_str());
+        return true;
+    }
+
+    ChunkCopyJob job;
+    job.sourceFd = sourceFd;
+    job.destFd = destFd;
+    job.fileSize = sourceStat.st_size;
+    job.chunkSize = options.chunkSize;
+    job.nextOffset = 0;
+    job.error = 0;
+    pthread_mutex_init(&job.lock, NULL);
+
+    // There's no point in starting more threads than there are chunks
+    off_t numChunks = std::max(job.fileSize / job.chunkSize + (job.fileSize % job.chunkSize != 0), static_cast<off_t>(1));
+    int numThreads = static_cast<int>(std::min(static_cast<off_t>(options.threads), numChunks));
+    std::vector<pthread_t> threads;
+
+    for (int i = 0; i < numThreads; i++) {
+        pthread_t thread;
+        int errorCode = pthread_create(&thread, NULL, copyChunks, &job);
+
+        if (errorCode != 0) {
+            // The threads that did start will pick up the remaining chunks
+            if (threads.empty()) {
+                std::cerr << "mysh: Couldn't create thread: " << std::strerror(errorCode) << std::endl;
+                job.error = errorCode;
+            }
+            break;
+        }
+
+        threads.push_back(thread);
+    }
+
+    for (int i = 0; i < static_cast<int>(threads.size()); i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    if (job.error != 0 && !threads.empty()) {
+        std::cerr << "mysh: " << source << " => " << dest << ": " << std::strerror(job.error) << std::endl;
+    }
+
+    pthread_mutex_destroy(&job.lock);
+    close(destFd);
+    close(sourceFd);
+
+    // The file was preallocated to its full size, so any chunks that weren't
+    // copied are zeros. Remove it so it can't be mistaken for a complete copy.
+    if (job.error != 0) {
+        unlink(dest.c_str());
+    }
+
+    return true;
+}
+
+void* copyChunks(void* arg) {
+    ChunkCopyJob* job = static_cast<ChunkCopyJob*>(arg);
+    char* buffer = new char[COPY_BUFFER_SIZE];
+
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+
+        if (job->error != 0 || job->nextOffset >= job->fileSize) {
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+
+        off_t offset = job->nextOffset;
+        off_t end = offset + std::min(job->chunkSize, job->fileSize - offset);
+        job->nextOffset = end;
+        pthread_mutex_unlock(&job->lock);
+
+        int errorCode = 0;
+
+        while (offset < end && errorCode == 0) {
+            size_t length = static_cast<size_t>(std::min(static_cast<off_t>(COPY_BUFFER_SIZE), end - offset));
+            ssize_t bytesRead = pread(job->sourceFd, buffer, length, offset);
+
+            if (bytesRead == -1 && errno == EINTR) {
+                continue;
+            }
+
+            if (bytesRead <= 0) {
+                // Reading 0 bytes means the source file shrank while we were copying it
+                errorCode = bytesRead == 0 ? EIO : errno;
+                break;
+            }
+
+            ssize_t bytesWritten = 0;
+
+            while (bytesWritten < bytesRead) {
+                ssize_t result = pwrite(job->destFd, buffer + bytesWritten, bytesRead - bytesWritten, offset + bytesWritten);
+
+                if (result == -1 && errno == EINTR) {
+                    continue;
+                }
+
+                if (result <= 0) {
+                    errorCode = result == 0 ? EIO : errno;
+                    break;
+                }
+
+                bytesWritten += result;
+            }
+
+            offset += bytesWritten;
+        }
+
+        if (errorCode != 0) {
+            pthread_mutex_lock(&job->lock);
+            if (job->error == 0) {
+                job->error = errorCode;
+            }
+            pthread_mutex_unlock(&job->lock);
+            break;
+        }
+    }
+
+    delete[] buffer;
+    return NULL;
+}
+
 void moveToDirectory(const std::string& path) {
     if (!Util::isDirectory(path)) {
         std::cerr << "mysh: " << path << ": Not a directory" << std::endl;
@@ -617,7 +1361,14 @@ void moveToDirectory(const std::string& path) {
     }
 }
 
-void copyDirectory(const char* source, const char* dest) {
+void copyDirectory(
+    const char* source,
+    const char* dest,
+    const CopyOptions& options,
+    const CopyFilter& filter,
+    const std::string& relativePath,
+    const bool included) {
+
     if (!Util::isDirectory(std::string(source))) {
         std::cerr << "mysh: " << source << ": Not a directory" << std::endl;
         return;
@@ -633,12 +1384,31 @@ void copyDirectory(const char* source, const char* dest) {
         return;
     }
 
-    if (!Util::isDirectory(std::string(dest)) && mkdir(dest, S_IRWXU | S_IRWXG | S_IRWXO) != 0) {
+    // The top-level destination and fully included directories are always created.
+    // Other directories are created when the first file is copied into them, so
+    // directories whose files are all filtered out don't show up as empty copies.
+    // Only subdirectories need their parents created, since those may have been
+    // skipped, and they always live under the top-level destination.
+    bool destCreated = false;
+
+    if (relativePath.empty() && !Util::isDirectory(std::string(dest)) && mkdir(dest, S_IRWXU | S_IRWXG | S_IRWXO) != 0) {
         std::cerr << "mysh: " << dest << " : " << std::strerror(errno) << std::endl;
         closedir(directory);
         return;
     }
 
+    if (relativePath.empty()) {
+        destCreated = true;
+    } else if (included) {
+        if (Util::makeDirectories(dest) != 0) {
+            std::cerr << "mysh: " << dest << " : " << std::strerror(errno) << std::endl;
+            closedir(directory);
+            return;
+        }
+
+        destCreated = true;
+    }
+
     std::vector<std::string> parts = Util::splitString(std::string(dest), '/');
     const char* baseDestPath = parts[0].c_str();
 
@@ -650,19 +1420,42 @@ void copyDirectory(const char* source, const char* dest) {
             continue;
         }
 
+        std::string entryPath = relativePath.empty() ? dir->d_name : relativePath + "/" + dir->d_name;
+
+        // Checking before recursing means excluded directories are never opened
+        if (Util::isPathExcluded(filter, dir->d_name, entryPath, dir->d_type == DT_DIR, included)) {
+            continue;
+        }
+
         snprintf(sourceBuffer, sizeof(sourceBuffer), "%s%c%s", source, '/', dir->d_name);
         snprintf(destBuffer, sizeof(destBuffer), "%s%c%s", dest, '/', dir->d_name);
 
         switch (dir->d_type) {
             case DT_REG: // File
+                if (!destCreated) {
+                    if (Util::makeDirectories(dest) != 0) {
+                        std::cerr << "mysh: " << dest << " : " << std::strerror(errno) << std::endl;
+                        closedir(directory);
+                        return;
+                    }
+
+                    destCreated = true;
+                }
+
                 std::cout << "mysh: " << sourceBuffer << " => " << destBuffer << std::endl;
-                copyFileToFile(sourceBuffer, destBuffer, true);
+                copyFileToFile(sourceBuffer, destBuffer, true, options);
                 break;
             case DT_DIR: // Directory
                 // Make sure we don't try to recursively copy the destination
                 // directory to the destination directory again.
                 if (strcmp(dir->d_name, baseDestPath) != 0) {
-                    copyDirectory(sourceBuffer, destBuffer);
+                    copyDirectory(
+                        sourceBuffer,
+                        destBuffer,
+                        options,
+                        filter,
+                        entryPath,
+                        included || Util::matchesPath(filter.include, dir->d_name, entryPath));
                 }
                 break;
         }